@@ -26,36 +26,236 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "ChromaKeyer.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
 #include <opencv2/imgcodecs/imgcodecs.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
-#define _CK_CHECKINPUTEMPTY					if(_input.empty())	{_stage = CK_ZERO; return false;} \
-											else				{_stage = CK_IMG_LOADED; return true;}
+#define _CK_CHECKINPUTEMPTY					invalidate(CK_STAGE_INPUT); \
+											if(_input.empty())	{return false;} \
+											else				{_valid |= CK_STAGE_INPUT; return true;}
 
 #define _CK_COLORWHITE                      Scalar(255,255,255)
 #define _CK_COLORCYAN                       Scalar(255,255,0)
 #define _CK_COLORYELLOW                      Scalar(0,255,255)
 
-#define _CK_STAGELOWER(LV)					((int)_stage < (LV))
-#define _CK_STAGEHIGHER(LV)					((int)_stage >= (LV))
-#define _CK_ASSERTSTAGE(LV,RETVAL)			if(_CK_STAGELOWER(LV)){return(RETVAL);}
+#define _CK_KERNELSIGMA(K)					(0.3f*(((K) - 1)*0.5f - 1.0f) + 0.8f)
+#define _CK_HASMATTECLEANUP					(_pars.matte_choke != 0 || _pars.matte_softness > 0.0f)
+
+#define _CK_STAGEVALID(ST)					((_valid & (ST)) != 0)
+#define _CK_ASSERTSTAGE(ST,RETVAL)			if(!_CK_STAGEVALID(ST)){return(RETVAL);}
 #define _CK_DRAWCROSS(MAT, PX, PY, WIDTH, COLOR)	cv::line(retval, Point(PX+WIDTH, PY+WIDTH), Point(PX-WIDTH, PY-WIDTH), COLOR); \
                                                     cv::line(retval, Point(PX+WIDTH, PY-WIDTH), Point(PX-WIDTH, PY+WIDTH), COLOR);
 
 using namespace cv;
 
+namespace
+{
+
+/**
+ * Chain of 1D filters run over every row of a CV_8U plane, with the rows split across threads.
+ * Erosion and dilation use the van Herk/Gil-Werman running min/max and the box filter a running
+ * sum, so the cost per pixel doesn't depend on the radius.
+*/
+class LineFilter : public ParallelLoopBody
+{
+public:
+    enum Kind
+    {
+        ERODE,
+        DILATE,
+        BOX
+    };
+
+    struct Op
+    {
+        Kind    kind;
+        int     radius;
+    };
+
+    LineFilter(Mat& plane, const std::vector<Op>& ops) :
+        _plane(plane),
+        _ops(ops)
+    {
+    }
+
+    virtual void operator()(const Range& range) const
+    {
+        int maxradius = 0;
+        for(size_t k = 0; k < _ops.size(); k++)
+            maxradius = std::max(maxradius, _ops[k].radius);
+
+        std::vector<uint8_t> work(_plane.cols);
+        std::vector<uint8_t> padded(_plane.cols + 4*maxradius + 1), g(padded.size()), h(padded.size());
+
+        for(int i = range.start; i < range.end; i++)
+        {
+            uint8_t* row = _plane.ptr<uint8_t>(i);
+            uint8_t* src = row;
+            uint8_t* dst = &work[0];
+
+            for(size_t k = 0; k < _ops.size(); k++)
+            {
+                if(_ops[k].radius <= 0)
+                    continue;
+
+                if(_ops[k].kind == BOX)
+                    runningBox(src, dst, _plane.cols, _ops[k].radius);
+                else
+                    runningMinMax(src, dst, _plane.cols, _ops[k].radius, _ops[k].kind == ERODE, &padded[0], &g[0], &h[0]);
+                std::swap(src, dst);
+            }
+
+            if(src != row)
+                memcpy(row, src, _plane.cols);
+        }
+    }
+
+    /**
+     * Applies the ops to the rows, then to the columns through a transposition. Erosion and dilation
+     * go fully before the box passes, since they don't commute.
+    */
+    static void run(Mat& plane, const std::vector<Op>& morph, const std::vector<Op>& blur)
+    {
+        std::vector<Op> both(morph);
+        Mat transposed;
+
+        both.insert(both.end(), blur.begin(), blur.end());
+
+        parallel_for_(Range(0, plane.rows), LineFilter(plane, morph));
+        transpose(plane, transposed);
+        parallel_for_(Range(0, transposed.rows), LineFilter(transposed, both));
+        transpose(transposed, plane);
+        parallel_for_(Range(0, plane.rows), LineFilter(plane, blur));
+    }
+
+    /**
+     * Radii of three box passes that approximate a gaussian blur of the given sigma.
+    */
+    static std::vector<Op> gaussianBoxes(float sigma)
+    {
+        const int   passes = 3;
+        float       wideal = std::sqrt(12.0f*sigma*sigma/passes + 1.0f);
+        int         wl = (int)wideal;
+        std::vector<Op> retval;
+
+        if(wl % 2 == 0)
+            wl--;
+        int m = cvRound((12.0f*sigma*sigma - passes*wl*wl - 4*passes*wl - 3*passes) / (-4.0f*wl - 4.0f));
+
+        for(int i = 0; i < passes; i++)
+        {
+            Op op = {BOX, ((i < m ? wl : wl + 2) - 1) / 2};
+            retval.push_back(op);
+        }
+        return retval;
+    }
+
+private:
+    Mat&                    _plane;
+    const std::vector<Op>&  _ops;
+
+    static void runningMinMax(const uint8_t* src, uint8_t* dst, int n, int r, bool erode,
+                              uint8_t* padded, uint8_t* g, uint8_t* h)
+    {
+        const int w =   2*r + 1;
+        const int len = (n + 2*r + w - 1) / w * w;
+
+        // Pads with the identity of the operation, so the borders don't take part.
+        memset(padded, erode ? 255 : 0, len);
+        memcpy(padded + r, src, n);
+
+        // Running min/max from the start and from the end of each block of w pixels.
+        for(int i = 0; i < len; i++)
+            g[i] = (i % w == 0) ? padded[i] : pick(g[i - 1], padded[i], erode);
+        for(int i = len - 1; i >= 0; i--)
+            h[i] = (i % w == w - 1) ? padded[i] : pick(h[i + 1], padded[i], erode);
+
+        // Any window of w pixels spans at most two blocks.
+        for(int x = 0; x < n; x++)
+            dst[x] = pick(h[x], g[x + 2*r], erode);
+    }
+
+    static void runningBox(const uint8_t* src, uint8_t* dst, int n, int r)
+    {
+        const int w = 2*r + 1;
+        int sum = (r + 1) * src[0];
+
+        for(int x = 1; x <= r; x++)
+            sum += src[std::min(x, n - 1)];
+
+        for(int x = 0; x < n; x++)
+        {
+            dst[x] = (uint8_t)((sum + r) / w);
+            sum += src[std::min(x + r + 1, n - 1)] - src[std::max(x - r, 0)];
+        }
+    }
+
+    static inline uint8_t pick(uint8_t a, uint8_t b, bool erode)
+    {
+        return erode ? std::min(a, b) : std::max(a, b);
+    }
+};
+
+}
+
 ChromaKeyer::ChromaKeyer() :
-	_stage(CK_ZERO)
+	_pars(),
+	_valid(0),
+	_maskmethod(CK_METHOD_CLASSIC),
+	_compositeplate(false),
+	_fusecomposite(false)
 {
 }
 
 ChromaKeyer::ChromaKeyer(ChromaKeyerParams& params) :
-	_stage(CK_ZERO)
+	_pars(),
+	_valid(0),
+	_maskmethod(CK_METHOD_CLASSIC),
+	_compositeplate(false),
+	_fusecomposite(false)
 {
 	setParams(params);
 }
 
+/**
+ * Marks the given stages, and every stage downstream of them, as stale.
+*/
+void ChromaKeyer::invalidate(int stages)
+{
+    for(int st = CK_STAGE_INPUT; st <= CK_STAGE_COMPOSITE; st <<= 1)
+    {
+        if(!(stages & st))
+            continue;
+
+        switch(st)
+        {
+            // The classic mask only needs the key color, not the classification map.
+            case CK_STAGE_KEYCOLOR:
+                stages |= CK_STAGE_TOLERANCES | CK_STAGE_CLASSMAP | CK_STAGE_MASK;
+            break;
+            // The classic mask is keyed on the tolerances it was built with.
+            case CK_STAGE_TOLERANCES:
+            break;
+            case CK_STAGE_CLASSMAP:
+                if(_maskmethod == CK_METHOD_AUTOMAGIC)
+                    stages |= CK_STAGE_MASK;
+            break;
+            case CK_STAGE_COMPOSITE:
+            break;
+            default:
+                stages |= st << 1;
+            break;
+        }
+    }
+
+    _valid &= ~stages;
+}
+
 /**
  * Utility to convert a pixel to CbCr values.
 */
@@ -121,49 +321,116 @@ bool ChromaKeyer::loadFromMat(Mat& input)
 	_CK_CHECKINPUTEMPTY
 }
 
-bool ChromaKeyer::generateHistogram(Mat* output)
+bool ChromaKeyer::generateCbCr()
 {
     std::vector<Mat> _input_cbcr3c;
+    Size chroma_size;
+
+    _CK_ASSERTSTAGE(CK_STAGE_INPUT, false);
+
+    if(_CK_STAGEVALID(CK_STAGE_CBCR))
+        return true;
+
+    // Convert to YCbCr.
+    cvtColor(_input, _inputcbcr, CV_RGB2YCrCb);
+    _inputcbcr.convertTo(_inputcbcr, CV_32F);
+    _inputcbcr /= 256.0f;
+    split(_inputcbcr, _input_cbcr3c);
+
+    switch(_pars.chroma_subsampling)
+    {
+        case CK_SUBSAMPLING_422:
+            chroma_size = Size((_input.cols + 1) / 2, _input.rows);
+        break;
+        case CK_SUBSAMPLING_420:
+            chroma_size = Size((_input.cols + 1) / 2, (_input.rows + 1) / 2);
+        break;
+        default:
+            chroma_size = _input.size();
+        break;
+    }
+
+    // The Y channel is only needed to guide the mask upsampling.
+    if(chroma_size != _input.size())
+    {
+        _inputluma = _input_cbcr3c[0];
+        resize(_input_cbcr3c[1], _input_cbcr3c[1], chroma_size, 0, 0, INTER_AREA);
+        resize(_input_cbcr3c[2], _input_cbcr3c[2], chroma_size, 0, 0, INTER_AREA);
+    }
+    else
+    {
+        _inputluma.release();
+    }
 
-	// Avoid unnecessary calculation if not needed, or return 
-	_CK_ASSERTSTAGE(CK_IMG_LOADED, false);
+    _input_cbcr3c.erase(_input_cbcr3c.begin());
+    merge(_input_cbcr3c, _inputcbcr);
 
+    _valid |= CK_STAGE_CBCR;
+    return true;
+}
+
+bool ChromaKeyer::generateRawHistogram()
+{
+    // Histogram calculation values
+    const int hist_channels[2] =   	{0, 1};
+    const int hist_size[2] =		{_pars.histogram_size, _pars.histogram_size};
+    const float hist_ranges_cb[2] = {0.0f, 1.0f};
+    const float hist_ranges_cr[2] = {0.0f, 1.0f};
+    const float* hist_ranges[2] =   {hist_ranges_cb, hist_ranges_cr};
+
+    if(_CK_STAGEVALID(CK_STAGE_RAWHISTOGRAM))
+        return true;
+
+    if(!generateCbCr())
+        return false;
+
+    // Generate a 2D histogram of CbCr values.
+    calcHist(&_inputcbcr, 1, hist_channels, Mat(), _realhisto,
+             2, hist_size, hist_ranges, true, false);
+
+    _valid |= CK_STAGE_RAWHISTOGRAM;
+    return true;
+}
+
+bool ChromaKeyer::generateHistogram(Mat* output)
+{
 	// Skip all of this if it has been generated already.
-	if(!_CK_STAGEHIGHER(CK_HISTOGRAM_GENERATED))
+	if(!_CK_STAGEVALID(CK_STAGE_ADAPTEDHISTOGRAM))
 	{
-		// Histogram calculation values
-        const int hist_channels[2] =   	{0, 1};
-		const int hist_size[2] =		{_pars.histogram_size, _pars.histogram_size};
-        const float hist_ranges_cb[2] = {0.0f, 1.0f};
-        const float hist_ranges_cr[2] = {0.0f, 1.0f};
-	    const float* hist_ranges[2] =   {hist_ranges_cb, hist_ranges_cr};
-
 	    // Adapted Histogram presets
 	    const float   	log_floor_preset = 		1.0f;
         int 			kernel_size_preset = 	_pars.histogram_size / 20;
         if(kernel_size_preset % 2 == 0)
             kernel_size_preset++;
 
-		// Convert to YCbCr. We don't need the Y channel.
-        cvtColor(_input, _inputcbcr, CV_RGB2YCrCb);
-        _inputcbcr.convertTo(_inputcbcr, CV_32F);
-        _inputcbcr /= 256.0f;
-        split(_inputcbcr, _input_cbcr3c);
-        _input_cbcr3c.erase(_input_cbcr3c.begin());
-        merge(_input_cbcr3c, _inputcbcr);
-
-	    // Generate a 2D histogram of CbCr values.
-        calcHist(&_inputcbcr, 1, hist_channels, Mat(), _realhisto,
-	             2, hist_size, hist_ranges, true, false);
+        if(!generateRawHistogram())
+            return false;
 
 	    // Adapts it to a logarithmic version.
-        _realhisto.convertTo(_adaptedhisto, CV_64F);
-        cv::add(_adaptedhisto, log_floor_preset, _adaptedhisto);
-        cv::GaussianBlur(_adaptedhisto, _adaptedhisto, Size(kernel_size_preset, kernel_size_preset), 0, 0);
-        cv::log(_adaptedhisto, _adaptedhisto);
-        normalize(_adaptedhisto, _adaptedhisto, 0.0, 1.0, NORM_MINMAX, CV_64F);
+        if(_pars.fast_histogram)
+        {
+            // Same in float32, with the gaussian approximated by box passes.
+            std::vector<LineFilter::Op> boxes = LineFilter::gaussianBoxes(_CK_KERNELSIGMA(kernel_size_preset));
+
+            _realhisto.convertTo(_adaptedhisto, CV_32F, 1.0, log_floor_preset);
+            for(size_t k = 0; k < boxes.size(); k++)
+            {
+                if(boxes[k].radius > 0)
+                    cv::boxFilter(_adaptedhisto, _adaptedhisto, CV_32F, Size(2*boxes[k].radius + 1, 2*boxes[k].radius + 1));
+            }
+            cv::log(_adaptedhisto, _adaptedhisto);
+            normalize(_adaptedhisto, _adaptedhisto, 0.0, 1.0, NORM_MINMAX, CV_32F);
+        }
+        else
+        {
+            _realhisto.convertTo(_adaptedhisto, CV_64F);
+            cv::add(_adaptedhisto, log_floor_preset, _adaptedhisto);
+            cv::GaussianBlur(_adaptedhisto, _adaptedhisto, Size(kernel_size_preset, kernel_size_preset), 0, 0);
+            cv::log(_adaptedhisto, _adaptedhisto);
+            normalize(_adaptedhisto, _adaptedhisto, 0.0, 1.0, NORM_MINMAX, CV_64F);
+        }
 
-	    _stage =	CK_HISTOGRAM_GENERATED;
+	    _valid |= CK_STAGE_ADAPTEDHISTOGRAM;
     }
 
     // Deep copies the Adapted histogram if requested.
@@ -176,9 +443,57 @@ bool ChromaKeyer::generateHistogram(Mat* output)
     return true;
 }
 
+bool ChromaKeyer::findKeyColor()
+{
+    if(!_CK_STAGEVALID(CK_STAGE_KEYCOLOR))
+    {
+        // Generates histogram if it hasn't been generated yet.
+        if(!generateHistogram())
+            return false;
+
+        // Finds BG color by selecting the most frequent color.
+        cv::minMaxIdx(_adaptedhisto, NULL, NULL, NULL, _bgindex, histomask());
+        // Histogram rows follow the first channel of the CbCr plane, and columns the second.
+        _bgcolor_cbcr[0] = (float)_bgindex[0]/(float)_pars.histogram_size;
+        _bgcolor_cbcr[1] = (float)_bgindex[1]/(float)_pars.histogram_size;
+
+        _valid |= CK_STAGE_KEYCOLOR;
+    }
+
+    _pars.bgcolor_cbcr = _bgcolor_cbcr;
+    return true;
+}
+
 void ChromaKeyer::setParams(ChromaKeyerParams& pars)
 {
-	memcpy(&_pars, &pars, sizeof(ChromaKeyerParams));
+    int stale = 0;
+
+    // Tolerances are not checked here: the classic mask is keyed on the ones it was built with.
+    if(pars.chroma_subsampling != _pars.chroma_subsampling)
+        stale |= CK_STAGE_CBCR;
+    if(pars.histogram_size != _pars.histogram_size)
+        stale |= CK_STAGE_RAWHISTOGRAM;
+    if(pars.fast_histogram != _pars.fast_histogram)
+        stale |= CK_STAGE_ADAPTEDHISTOGRAM;
+    if(pars.auto_tolerance != _pars.auto_tolerance)
+        stale |= CK_STAGE_TOLERANCES;
+    if(pars.auto_color_threshold != _pars.auto_color_threshold ||
+            pars.auto_color_expansion != _pars.auto_color_expansion)
+        stale |= CK_STAGE_CLASSMAP;
+    if(pars.matte_choke != _pars.matte_choke || pars.matte_softness != _pars.matte_softness)
+        stale |= CK_STAGE_MATTE;
+
+    memcpy(&_pars, &pars, sizeof(ChromaKeyerParams));
+    invalidate(stale);
+
+    // The key color is found, not given. Keep it while it's still valid, and so the tolerances.
+    if(_CK_STAGEVALID(CK_STAGE_KEYCOLOR))
+        _pars.bgcolor_cbcr = _bgcolor_cbcr;
+    if(_pars.auto_tolerance && _CK_STAGEVALID(CK_STAGE_TOLERANCES))
+    {
+        _pars.tolerance_lo = _autotolerance[0];
+        _pars.tolerance_hi = _autotolerance[1];
+    }
 }
 
 Mat ChromaKeyer::getHistogram() const
@@ -204,10 +519,11 @@ cv::Mat ChromaKeyer::drawHistogram(bool markings)
         // Draw crosshair on key color
         const int x_width = 3;
 
-        int bgcolor_position[2] = {(int)((float)_pars.histogram_size * _pars.bgcolor_cbcr[0]),
-                                    (int)((float)_pars.histogram_size * _pars.bgcolor_cbcr[1])};
-        int fgcolor_position[2] = {(int)((float)_pars.histogram_size * _pars.fgcolor_cbcr[0]),
-                                    (int)((float)_pars.histogram_size * _pars.fgcolor_cbcr[1])};
+        // As x, y: the second channel goes along the columns.
+        int bgcolor_position[2] = {(int)((float)_pars.histogram_size * _pars.bgcolor_cbcr[1]),
+                                    (int)((float)_pars.histogram_size * _pars.bgcolor_cbcr[0])};
+        int fgcolor_position[2] = {(int)((float)_pars.histogram_size * _pars.fgcolor_cbcr[1]),
+                                    (int)((float)_pars.histogram_size * _pars.fgcolor_cbcr[0])};
 
         // Cross on CbCr maximum
         _CK_DRAWCROSS(retval, bgcolor_position[0], bgcolor_position[1], x_width, _CK_COLORWHITE);
@@ -227,38 +543,138 @@ cv::Mat ChromaKeyer::drawHistogram(bool markings)
 	return retval;
 }
 
+/**
+ * Picks the tolerances from a radial profile of the adapted histogram around the key color, split
+ * Otsu style into key and foreground colors. Costs as much as the number of histogram bins,
+ * whatever the image size.
+*/
+bool ChromaKeyer::findTolerances()
+{
+    if(!_CK_STAGEVALID(CK_STAGE_TOLERANCES))
+    {
+        const int   size =  _pars.histogram_size;
+        const int   rings = (int)std::ceil(size * std::sqrt(2.0)) + 1;
+
+        std::vector<double> profile(rings, 0.0);
+        double      total = 0.0, totalmoment = 0.0;
+        double      weight_bg = 0.0, moment_bg = 0.0, spread_bg = 0.0;
+        double      best_variance = -1.0;
+        int         split = 0, split_end = 0;
+        float       bg_mean, bg_deviation, lo, hi;
+        Mat         histo;
+
+        if(!findKeyColor())
+            return false;
+
+        // The adapted histogram is CV_32F or CV_64F depending on how it was built.
+        if(_adaptedhisto.depth() == CV_64F)
+            histo = _adaptedhisto;
+        else
+            _adaptedhisto.convertTo(histo, CV_64F);
+
+        // Radial profile, one ring per histogram bin of distance.
+        for(int i = 0; i < size; i++)
+        {
+            const double* historow = histo.ptr<double>(i);
+
+            for(int j = 0; j < size; j++)
+            {
+                int di = i - _bgindex[0], dj = j - _bgindex[1];
+                profile[cvRound(std::sqrt((double)(di*di + dj*dj)))] += historow[j];
+            }
+        }
+
+        for(int r = 0; r < rings; r++)
+        {
+            total +=        profile[r];
+            totalmoment +=  r * profile[r];
+        }
+
+        // Otsu: the ring that maximizes the variance between the key and the foreground classes. Empty
+        // rings keep it flat, so the split goes to the middle of that valley.
+        for(int r = 0; r < rings - 1; r++)
+        {
+            weight_bg += profile[r];
+            moment_bg += r * profile[r];
+            if(weight_bg <= 0.0 || weight_bg >= total)
+                continue;
+
+            double mean_bg = moment_bg / weight_bg;
+            double mean_fg = (totalmoment - moment_bg) / (total - weight_bg);
+            double variance = weight_bg * (total - weight_bg) * (mean_bg - mean_fg) * (mean_bg - mean_fg);
+            if(variance > best_variance)
+            {
+                best_variance = variance;
+                split = split_end = r;
+            }
+            else if(variance == best_variance && profile[r] == 0.0 && split_end == r - 1)
+            {
+                split_end = r;
+            }
+        }
+        split = (split + split_end) / 2;
+
+        // The key color spread sets where transparency starts, and the ramp is centered on the split.
+        weight_bg = moment_bg = 0.0;
+        for(int r = 0; r <= split; r++)
+        {
+            weight_bg += profile[r];
+            moment_bg += r * profile[r];
+        }
+        bg_mean = weight_bg > 0.0 ? moment_bg / weight_bg : 0.0;
+        for(int r = 0; r <= split; r++)
+            spread_bg += profile[r] * (r - bg_mean) * (r - bg_mean);
+        bg_deviation = weight_bg > 0.0 ? std::sqrt(spread_bg / weight_bg) : 0.0;
+
+        lo = std::min(bg_mean + 2.0f * bg_deviation, (float)split);
+        hi = std::max(2.0f * split - lo, lo + 1.0f);
+
+        _autotolerance[0] = std::min(lo / size, 1.0f);
+        _autotolerance[1] = std::min(hi / size, 1.0f);
+
+        _valid |= CK_STAGE_TOLERANCES;
+    }
+
+    _pars.tolerance_lo = _autotolerance[0];
+    _pars.tolerance_hi = _autotolerance[1];
+    return true;
+}
+
 bool ChromaKeyer::generateMaskClassic()
 {
+    if(_pars.auto_tolerance && !findTolerances())
+        return false;
+
     return generateMaskClassic(_pars.tolerance_lo, _pars.tolerance_hi);
 }
 
 bool ChromaKeyer::generateMaskClassic(double tolerance_lo, double tolerance_hi)
 {
-    int bgindex[2];
     float distance;
     Vec2f distance_ref;
+    bool fuse;
 
     if(tolerance_lo > tolerance_hi ||
             tolerance_lo < 0.0 || tolerance_hi < 0.0 ||
             tolerance_lo > 1.0 || tolerance_hi > 1.0)
         return false;
 
-    // Generates histogram if it hasn't been generated yet.
-    if(_CK_STAGELOWER(CK_HISTOGRAM_GENERATED))
-    {
-        if(!generateHistogram())
-            return false;
-    }
+    if(!findKeyColor())
+        return false;
+
+    // Skip it if this very mask has been generated already.
+    if(_CK_STAGEVALID(CK_STAGE_MASK) && _maskmethod == CK_METHOD_CLASSIC &&
+            _masktolerance[0] == tolerance_lo && _masktolerance[1] == tolerance_hi)
+        return generateMatte();
 
-    // Finds BG color by selecting the most frequent color.
-    cv::minMaxIdx(_adaptedhisto, NULL, NULL, NULL, bgindex, histomask());
-    _pars.bgcolor_cbcr[0] = (float)bgindex[1]/(float)_pars.histogram_size;
-    _pars.bgcolor_cbcr[1] = (float)bgindex[0]/(float)_pars.histogram_size;
+    invalidate(CK_STAGE_MASK);
 
-    _mask = Mat(_input.rows, _input.cols, CV_32F);
+    _mask = Mat(_inputcbcr.rows, _inputcbcr.cols, CV_8UC1);
 
     distance_ref =  _pars.bgcolor_cbcr;
 
+    fuse = beginFusedComposite();
+
     // Map pixels to alpha values.
     for(int i = 0; i < _mask.rows; i++)
     {
@@ -267,75 +683,279 @@ bool ChromaKeyer::generateMaskClassic(double tolerance_lo, double tolerance_hi)
             distance = cv::norm(_inputcbcr.at<Vec2f>(i,j), distance_ref);
             if(distance <= tolerance_lo)
             {
-                _mask.at<float>(i,j) = 0.0f;
+                _mask.at<uint8_t>(i,j) = 0;
             }
             else if(distance >= tolerance_hi)
             {
-                _mask.at<float>(i,j) = 255.0f;
+                _mask.at<uint8_t>(i,j) = 255;
             }
             else
             {
-                _mask.at<float>(i,j) = 255.0f*(distance - tolerance_lo)/(tolerance_hi - tolerance_lo);
+                _mask.at<uint8_t>(i,j) = saturate_cast<uint8_t>(255.0f*(distance - tolerance_lo)/(tolerance_hi - tolerance_lo));
             }
         }
+
+        if(fuse)
+            compositeRow(i, _mask.ptr<uint8_t>(i));
     }
-    _mask.convertTo(_mask, CV_8UC1);
+    upsampleMask();
 
-    _stage =	CK_MASK_GENERATED;
-    return true;
+    _maskmethod =           CK_METHOD_CLASSIC;
+    _masktolerance[0] =     tolerance_lo;
+    _masktolerance[1] =     tolerance_hi;
+    _valid |= CK_STAGE_MASK;
+
+    endFusedComposite();
+    return generateMatte();
 }
 
-bool ChromaKeyer::generateMaskAuto()
+bool ChromaKeyer::generateMaskMap()
 {
-    int bgindex[2];
     Mat fgmask, fgblobs, dil_kernel;
-    int cclabels, label_key;
-    Mat _maskmap;
-    Vec2f cbcrvalues;
-    float pixel;
+    int label_key;
+    std::vector<LineFilter::Op> morph, blur;
 
     int   bg_expansion = _pars.auto_color_expansion * (float)_pars.histogram_size;
     if(bg_expansion % 2 == 0)
         bg_expansion++;
 
-    // Generates histogram if it hasn't been generated yet.
-    if(_CK_STAGELOWER(CK_HISTOGRAM_GENERATED))
-    {
-        if(!generateHistogram())
-            return false;
-    }
+    if(_CK_STAGEVALID(CK_STAGE_CLASSMAP))
+        return true;
 
-    // Finds BG color by selecting the most frequent color.
-    cv::minMaxIdx(_adaptedhisto, NULL, NULL, NULL, bgindex, histomask());
-    _pars.bgcolor_cbcr[0] = (float)bgindex[1]/(float)_pars.histogram_size;
-    _pars.bgcolor_cbcr[1] = (float)bgindex[0]/(float)_pars.histogram_size;
+    if(!findKeyColor())
+        return false;
 
     // Prepares a removal mask
     fgmask = _adaptedhisto > _pars.auto_color_threshold;
-    cclabels = cv::connectedComponents(fgmask, fgblobs, 8, CV_32S);
 
-    label_key =     fgblobs.at<int>(bgindex[0], bgindex[1]);
-    _maskmap =      fgblobs != label_key;
+    if(_pars.fast_histogram)
+    {
+        // Only the blob holding the key color matters, so flood it instead of labelling them all.
+        if(fgmask.at<uint8_t>(_bgindex[0], _bgindex[1]))
+        {
+            cv::floodFill(fgmask, Point(_bgindex[1], _bgindex[0]), Scalar(128), NULL, Scalar(), Scalar(), 8);
+            _maskmap =  fgmask != 128;
+        }
+        else
+        {
+            _maskmap =  fgmask != 0;
+        }
+
+        LineFilter::Op op = {LineFilter::ERODE, (bg_expansion - 1) / 2};
+        morph.push_back(op);
+        blur = LineFilter::gaussianBoxes(_CK_KERNELSIGMA(bg_expansion));
+        LineFilter::run(_maskmap, morph, blur);
+    }
+    else
+    {
+        cv::connectedComponents(fgmask, fgblobs, 8, CV_32S);
+
+        label_key =     fgblobs.at<int>(_bgindex[0], _bgindex[1]);
+        _maskmap =      fgblobs != label_key;
+
+        dil_kernel =    Mat::ones(bg_expansion, bg_expansion, CV_8U);
+        cv::erode(_maskmap, _maskmap, dil_kernel);
+        cv::GaussianBlur(_maskmap, _maskmap, Size(bg_expansion, bg_expansion), 0, 0);
+    }
+
+    _valid |= CK_STAGE_CLASSMAP;
+    return true;
+}
+
+bool ChromaKeyer::generateMaskAuto()
+{
+    Vec2f cbcrvalues;
+    bool fuse;
+
+    if(!generateMaskMap())
+        return false;
+
+    // Skip it if this very mask has been generated already.
+    if(_CK_STAGEVALID(CK_STAGE_MASK) && _maskmethod == CK_METHOD_AUTOMAGIC)
+        return generateMatte();
 
-    dil_kernel =    Mat::ones(bg_expansion, bg_expansion, CV_8U);
-    cv::erode(_maskmap, _maskmap, dil_kernel);
-    cv::GaussianBlur(_maskmap, _maskmap, Size(bg_expansion, bg_expansion), 0, 0);
+    invalidate(CK_STAGE_MASK);
 
     // Map pixels into alpha values
-    _mask = Mat(_input.rows, _input.cols, CV_32F);
+    _mask = Mat(_inputcbcr.rows, _inputcbcr.cols, CV_8UC1);
+
+    fuse = beginFusedComposite();
 
     for(int i = 0; i < _mask.rows; i++)
     {
         for(int j = 0; j < _mask.cols; j++)
         {
             cbcrvalues = _inputcbcr.at<Vec2f>(i,j) * _pars.histogram_size;
-            pixel = _maskmap.at<uint8_t>(cbcrvalues[0], cbcrvalues[1]);
-            _mask.at<float>(i,j) = pixel;
+            _mask.at<uint8_t>(i,j) = _maskmap.at<uint8_t>(cbcrvalues[0], cbcrvalues[1]);
         }
+
+        if(fuse)
+            compositeRow(i, _mask.ptr<uint8_t>(i));
     }
-    _mask.convertTo(_mask, CV_8UC1);
+    upsampleMask();
+
+    _maskmethod =   CK_METHOD_AUTOMAGIC;
+    _valid |= CK_STAGE_MASK;
+
+    endFusedComposite();
+    return generateMatte();
+}
+
+/**
+ * Brings a mask computed at chroma resolution to the input resolution. Uses a guided filter with the
+ * luma plane as guide, so edges follow the full resolution detail instead of the chroma blocks.
+*/
+void ChromaKeyer::upsampleMask()
+{
+    // Guided filter presets, in chroma resolution pixels.
+    const int       radius_preset = 2;
+    const double    eps_preset =    1e-4;
+
+    Size ksize(2*radius_preset + 1, 2*radius_preset + 1);
+    Mat luma, alpha, mean_I, mean_p, corr_II, corr_Ip, a, b;
+
+    if(_mask.size() == _input.size())
+        return;
+
+    resize(_inputluma, luma, _mask.size(), 0, 0, INTER_AREA);
+    _mask.convertTo(alpha, CV_32F, 1.0/255.0);
+
+    // Local linear model alpha = a*luma + b, fitted at chroma resolution.
+    boxFilter(luma, mean_I, CV_32F, ksize);
+    boxFilter(alpha, mean_p, CV_32F, ksize);
+    boxFilter(luma.mul(luma), corr_II, CV_32F, ksize);
+    boxFilter(luma.mul(alpha), corr_Ip, CV_32F, ksize);
+
+    a = (corr_Ip - mean_I.mul(mean_p)) / (corr_II - mean_I.mul(mean_I) + eps_preset);
+    b = mean_p - a.mul(mean_I);
+    boxFilter(a, a, CV_32F, ksize);
+    boxFilter(b, b, CV_32F, ksize);
+
+    // Then evaluated on the full resolution luma.
+    resize(a, a, _input.size(), 0, 0, INTER_LINEAR);
+    resize(b, b, _input.size(), 0, 0, INTER_LINEAR);
+    _mask = Mat(_input.rows, _input.cols, CV_8UC1);
+
+    for(int i = 0; i < _mask.rows; i++)
+    {
+        const float*    arow =      a.ptr<float>(i);
+        const float*    brow =      b.ptr<float>(i);
+        const float*    lumarow =   _inputluma.ptr<float>(i);
+        uint8_t*        maskrow =   _mask.ptr<uint8_t>(i);
+
+        for(int j = 0; j < _mask.cols; j++)
+        {
+            maskrow[j] = saturate_cast<uint8_t>(255.0f * (arow[j]*lumarow[j] + brow[j]));
+        }
+
+        if(_fusecomposite)
+            compositeRow(i, maskrow);
+    }
+}
+
+/**
+ * Call with a freshly allocated _mask, before the mask generator loop. Returns whether the loop
+ * should blend each row as soon as its alpha is known: not if the mask still has to be upsampled,
+ * as upsampleMask() does the blending then.
+*/
+bool ChromaKeyer::beginFusedComposite()
+{
+    if(!_fusecomposite)
+        return false;
+
+    preparePlate();
+    return _mask.size() == _input.size();
+}
 
-    _stage =	CK_MASK_GENERATED;
+/**
+ * Call once the mask is final. A fused blend needs no matte cleanup, so the matte is the mask
+ * itself and the composite is done.
+*/
+void ChromaKeyer::endFusedComposite()
+{
+    if(!_fusecomposite)
+        return;
+
+    _matte = _mask;
+    _compositeplate = true;
+    _valid |= CK_STAGE_MATTE | CK_STAGE_COMPOSITE;
+}
+
+/**
+ * Gets the background plate and the output ready for compositeRow().
+*/
+void ChromaKeyer::preparePlate()
+{
+    if(_background.size() != _input.size())
+        resize(_background, _plate, _input.size(), 0, 0, INTER_LINEAR);
+    else
+        _plate = _background;
+
+    _output = Mat(_input.rows, _input.cols, CV_8UC3);
+}
+
+/**
+ * Blends a row of the input over the background plate.
+*/
+void ChromaKeyer::compositeRow(int row, const uint8_t* alpharow)
+{
+    const uint8_t*  fgrow =     _input.ptr<uint8_t>(row);
+    const uint8_t*  bgrow =     _plate.ptr<uint8_t>(row);
+    uint8_t*        outrow =    _output.ptr<uint8_t>(row);
+    int             alpha;
+
+    for(int j = 0; j < _output.cols; j++)
+    {
+        alpha = alpharow[j];
+        for(int c = 0; c < 3; c++)
+        {
+            outrow[3*j + c] = (uint8_t)((fgrow[3*j + c]*alpha + bgrow[3*j + c]*(255 - alpha) + 127) / 255);
+        }
+    }
+}
+
+bool ChromaKeyer::generateMatte()
+{
+    std::vector<LineFilter::Op> morph, blur;
+
+    if(_CK_STAGEVALID(CK_STAGE_MATTE))
+        return true;
+
+    _CK_ASSERTSTAGE(CK_STAGE_MASK, false);
+
+    if(!_CK_HASMATTECLEANUP)
+    {
+        _matte = _mask;
+    }
+    else
+    {
+        // _matte may still alias _mask from a run without cleanup. Filtering must not touch the mask.
+        _matte = _mask.clone();
+
+        if(_pars.matte_choke != 0)
+        {
+            LineFilter::Op op = {_pars.matte_choke > 0 ? LineFilter::ERODE : LineFilter::DILATE,
+                                 std::abs(_pars.matte_choke)};
+            morph.push_back(op);
+        }
+        if(_pars.matte_softness > 0.0f)
+            blur = LineFilter::gaussianBoxes(_pars.matte_softness);
+
+        LineFilter::run(_matte, morph, blur);
+    }
+
+    _valid |= CK_STAGE_MATTE;
+    return true;
+}
+
+bool ChromaKeyer::setBackground(Mat& background)
+{
+    if(background.type() != CV_8UC3)
+        return false;
+
+    background.copyTo(_background);
+    if(_compositeplate)
+        invalidate(CK_STAGE_COMPOSITE);
     return true;
 }
 
@@ -359,12 +979,67 @@ Mat ChromaKeyer::applyChromaKey(ChromaKeyerMethod method)
     if(!result)
         return retval;
 
-    // Mask should be generated as for now.
-    split(_input, inputlayers);
-    inputlayers.push_back(_mask);
-    merge(inputlayers, retval);
+    if(!_CK_STAGEVALID(CK_STAGE_COMPOSITE) || _compositeplate)
+    {
+        // Matte should be generated as for now.
+        split(_input, inputlayers);
+        inputlayers.push_back(_matte);
 
-    return retval;
+        // Callers may still hold the previous output. Never write over it.
+        _output.release();
+        merge(inputlayers, _output);
+
+        _compositeplate = false;
+        _valid |= CK_STAGE_COMPOSITE;
+    }
+
+    return _output;
+}
+
+Mat ChromaKeyer::composite(ChromaKeyerMethod method)
+{
+    Mat retval;
+    bool result = false;
+
+    // compositeRow() blends BGR bytes only.
+    if(_background.empty() || _input.type() != CV_8UC3)
+        return retval;
+
+    // An unblended BGRA output is of no use here.
+    if(!_compositeplate)
+        invalidate(CK_STAGE_COMPOSITE);
+
+    // Mask generation blends over the plate on the way if it has to run and nothing is left to do
+    // to the mask afterwards.
+    _fusecomposite = !_CK_HASMATTECLEANUP;
+    switch(method)
+    {
+        case CK_METHOD_CLASSIC:
+            result = generateMaskClassic();
+        break;
+        case CK_METHOD_AUTOMAGIC:
+            result = generateMaskAuto();
+        break;
+    }
+    _fusecomposite = false;
+
+    if(!result)
+        return retval;
+
+    // Otherwise only the blending is left.
+    if(!_CK_STAGEVALID(CK_STAGE_COMPOSITE))
+    {
+        preparePlate();
+        for(int i = 0; i < _output.rows; i++)
+        {
+            compositeRow(i, _matte.ptr<uint8_t>(i));
+        }
+
+        _compositeplate = true;
+        _valid |= CK_STAGE_COMPOSITE;
+    }
+
+    return _output;
 }
 
 ChromaKeyerParams ChromaKeyer::getParams() const
@@ -374,5 +1049,5 @@ ChromaKeyerParams ChromaKeyer::getParams() const
 
 Mat ChromaKeyer::getMask() const
 {
-    return _mask;
+    return _matte;
 }
@@ -31,6 +31,18 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+/**
+ * @brief Resolution the chroma is keyed at. Subsampled modes evaluate alpha on the CbCr plane only,
+ * then upsample it to full resolution guided by the luma plane. Color conversion and upsampling still
+ * run at full resolution, so this is not a speedup by itself: check it with main's --benchmark.
+*/
+enum ChromaKeyerSubsampling
+{
+    CK_SUBSAMPLING_444 = 444,
+    CK_SUBSAMPLING_422 = 422,
+    CK_SUBSAMPLING_420 = 420
+};
+
 /**
  * @brief Used as initializing arguments.
 */
@@ -42,20 +54,42 @@ struct ChromaKeyerParams
 
 	float	tolerance_hi, tolerance_lo, tolerance_mask;
 
+	// Picks tolerance_hi and tolerance_lo from the histogram instead.
+	bool 	auto_tolerance;
+
 	int 	histogram_size;
 
+	// Float32 histogram, flood filled key component and constant-time filters for the automagic map.
+	bool 	fast_histogram;
+
     float   auto_color_threshold, auto_color_expansion;
+
+    ChromaKeyerSubsampling  chroma_subsampling;
+
+    // Matte cleanup: choke in pixels (negative spreads), softness as a gaussian sigma in pixels.
+    int     matte_choke;
+    float   matte_softness;
 };
 
 /**
-* @brief Used internally to avoid redundant work.
+* @brief Used internally to avoid redundant work. Each stage of the pipeline is a bit of a validity
+* mask: invalidating a stage also invalidates every stage that depends on it, so a parameter change
+* only re-runs what it affects.
+*
+* input -> CbCr plane -> raw histogram -> adapted histogram -> key color -> tolerances or classification map -> mask -> matte -> composite
 */
 enum _ChromaKeyerStage
 {
-	CK_ZERO,
-	CK_IMG_LOADED,
-	CK_HISTOGRAM_GENERATED,
-	CK_MASK_GENERATED
+	CK_STAGE_INPUT =			1 << 0,
+	CK_STAGE_CBCR =				1 << 1,
+	CK_STAGE_RAWHISTOGRAM =		1 << 2,
+	CK_STAGE_ADAPTEDHISTOGRAM =	1 << 3,
+	CK_STAGE_KEYCOLOR =			1 << 4,
+	CK_STAGE_TOLERANCES =		1 << 5,
+	CK_STAGE_CLASSMAP =			1 << 6,
+	CK_STAGE_MASK =				1 << 7,
+	CK_STAGE_MATTE =			1 << 8,
+	CK_STAGE_COMPOSITE =		1 << 9
 };
 
 enum ChromaKeyerMethod
@@ -69,11 +103,39 @@ class ChromaKeyer
 private:
 	ChromaKeyerParams _pars;
 
-    cv::Mat 	_input, _inputcbcr;
+    cv::Mat 	_input, _inputcbcr, _inputluma;
     cv::Mat 	_realhisto, _adaptedhisto;
-    cv::Mat 	_mask;
-
-	_ChromaKeyerStage _stage;
+    cv::Mat 	_maskmap;
+    cv::Mat 	_mask, _matte;
+    cv::Mat 	_background, _plate;
+    cv::Mat 	_output;
+
+	int 		_valid;
+
+	// Keys of the stages whose inputs are not all in _pars.
+	int 				_bgindex[2];
+	cv::Vec2f 			_bgcolor_cbcr;
+	float 				_autotolerance[2];
+	ChromaKeyerMethod 	_maskmethod;
+	double 				_masktolerance[2];
+	bool 				_compositeplate;
+
+	// Set while a mask generator should blend over the background plate as it goes.
+	bool 		_fusecomposite;
+
+	void invalidate(int stages);
+
+	bool generateCbCr();
+	bool generateRawHistogram();
+	bool findKeyColor();
+	bool findTolerances();
+	bool generateMaskMap();
+	bool generateMatte();
+	void upsampleMask();
+	bool beginFusedComposite();
+	void endFusedComposite();
+	void preparePlate();
+	void compositeRow(int row, const uint8_t* alpharow);
 
 public:
     cv::Mat     histomask();
@@ -95,14 +157,18 @@ public:
 
 	// Setters
 	void setParams(ChromaKeyerParams& pars);
+	bool setBackground(cv::Mat& background);
 
-    // Mask generators
+    // Mask generators. Matte cleanup, if any, runs on their result.
     bool generateMaskClassic();
     bool generateMaskClassic(double tolerancelo, double tolerancehi);
     bool generateMaskAuto();
 
-    // Merger
+    // Mergers. The returned Mat shares the cached output: repeated calls may hand out the same buffer,
+    // so treat it as read-only and clone() it before drawing on it. A recompute never writes into a
+    // Mat returned before.
     cv::Mat applyChromaKey(ChromaKeyerMethod method = CK_METHOD_CLASSIC);
+    cv::Mat composite(ChromaKeyerMethod method = CK_METHOD_CLASSIC);
 
 	// Getters
 	cv::Mat getHistogram() const;
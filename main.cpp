@@ -24,9 +24,11 @@ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVE
 POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgcodecs/imgcodecs.hpp>
@@ -38,15 +40,69 @@ POSSIBILITY OF SUCH DAMAGE.
 
 using namespace cv;
 
+/**
+ * Keys the same image at full and at chroma resolution, then reports the median time of each and
+ * the alpha error of the latter around the edges of the full resolution mask. One untimed run warms
+ * OpenCV up first, and the timed runs alternate between both modes.
+*/
+static void benchmarkSubsampling(std::string filein, ChromaKeyerParams ckp, ChromaKeyerMethod method)
+{
+    const int runs = 7;
+
+    ChromaKeyer ck;
+    Mat input, masks[2], edges, diff;
+    std::vector<double> seconds[2];
+    int64 ticks;
+
+    const ChromaKeyerSubsampling modes[2] = {CK_SUBSAMPLING_444,
+        ckp.chroma_subsampling == CK_SUBSAMPLING_444 ? CK_SUBSAMPLING_420 : ckp.chroma_subsampling};
+
+    input = imread(filein);
+    if(input.empty())
+        return;
+
+    for(int run = -1; run < runs; run++)
+    {
+        for(int i = 0; i < 2; i++)
+        {
+            ckp.chroma_subsampling = modes[i];
+            ck.setParams(ckp);
+            ck.loadFromMat(input);
+
+            ticks = getTickCount();
+            ck.applyChromaKey(method);
+            if(run >= 0)
+                seconds[i].push_back((double)(getTickCount() - ticks) / getTickFrequency());
+
+            ck.getMask().copyTo(masks[i]);
+        }
+    }
+
+    for(int i = 0; i < 2; i++)
+        std::sort(seconds[i].begin(), seconds[i].end());
+
+    // Edge band: wherever the full resolution mask is not flat.
+    morphologyEx(masks[0], edges, MORPH_GRADIENT, Mat::ones(3, 3, CV_8U));
+    edges = edges > 0;
+    absdiff(masks[0], masks[1], diff);
+
+    std::cerr << "4:4:4 keying: " << seconds[0][runs / 2] * 1000.0 << " ms median of " << runs << std::endl;
+    std::cerr << modes[1] / 100 << ":" << modes[1] / 10 % 10 << ":" << modes[1] % 10 << " keying: "
+              << seconds[1][runs / 2] * 1000.0 << " ms median of " << runs << std::endl;
+    std::cerr << "Mean alpha error: " << mean(diff)[0] << " overall, "
+              << mean(diff, edges)[0] << " on edges" << std::endl;
+}
+
 int main(int argc, char** argv)
 {
-    bool f_automagic;
+    bool f_automagic, f_benchmark;
+    int subsampling;
     Flags flags;
 
-    std::string filein, fileout;
+    std::string filein, fileout, filebg;
 
     ChromaKeyer ck;
-    Mat matout;
+    Mat matout, matbg;
 
 	ChromaKeyerParams ckp = {
 		.bgcolor_rgb =		Vec3f(0.0f, 1.0f, 0.0f),
@@ -56,29 +112,51 @@ int main(int argc, char** argv)
         .tolerance_hi =		0.30f,
         .tolerance_lo =		0.25f,
 		.tolerance_mask =	0.05f,
+		.auto_tolerance =	false,
 
         .histogram_size = 	512,
+        .fast_histogram =   false,
 
         .auto_color_threshold = 0.25f,
-        .auto_color_expansion = 0.08f
+        .auto_color_expansion = 0.08f,
+
+        .chroma_subsampling =   CK_SUBSAMPLING_444,
+
+        .matte_choke =          0,
+        .matte_softness =       0.0f
 	};
 
     flags.Var(filein, 'i', "input", std::string(), "Input image (required)");
     flags.Var(fileout, 'o', "output", std::string(), "Output image (required)");
+    flags.Var(filebg, 'b', "background", std::string(), "Background plate. If set, the output is composited over it instead of being transparent");
 
     flags.Var(ckp.tolerance_lo, 'l', "thresholdlow", 0.25f, "Low threshold - 0.0 to 1.0", "Classic method");
     flags.Var(ckp.tolerance_hi, 'h', "thresholdhigh", 0.30f, "High threshold - 0.0 to 1.0", "Classic method");
+    flags.Bool(ckp.auto_tolerance, 0, "autotolerance", "Pick the thresholds from the color histogram.", "Classic method");
+
+    flags.Var(ckp.histogram_size, 'z', "histogramsize", 512, "Histogram bins per chroma axis - 1 or more", "Histogram");
+    flags.Bool(ckp.fast_histogram, 0, "fasthistogram", "Float32 histogram and constant-time filters. Pays off with large histograms.", "Histogram");
 
     flags.Bool(f_automagic, 'a', "automagic", "Use automagic method instead of the classic one.", "Automagic method");
     flags.Var(ckp.auto_color_threshold, 'e', "expansion", 0.08f, "Color expansion factor - 0.0 to 1.0", "Automagic method");
     flags.Var(ckp.auto_color_threshold, 't', "autothreshold", 0.25f, "Color separation threshold - 0.0 to 1.0", "Automagic method");
 
-    if(!flags.Parse(argc, argv) || argc == 1 || filein == std::string() || fileout == std::string())
+    flags.Var(subsampling, 's', "subsampling", 444, "Key chroma at 444, 422 or 420 resolution", "Chroma subsampling");
+    flags.Bool(f_benchmark, 0, "benchmark", "Compare subsampled keying against full resolution keying.", "Chroma subsampling");
+
+    flags.Var(ckp.matte_choke, 'c', "choke", 0, "Shrinks the matte by this many pixels. Negative values spread it", "Matte cleanup");
+    flags.Var(ckp.matte_softness, 'f', "feather", 0.0f, "Softens the matte edges, as a gaussian sigma in pixels", "Matte cleanup");
+
+    // calcHist() and histomask() abort on empty histograms.
+    if(!flags.Parse(argc, argv) || argc == 1 || filein == std::string() || fileout == std::string() ||
+            ckp.histogram_size <= 0 ||
+            (subsampling != CK_SUBSAMPLING_444 && subsampling != CK_SUBSAMPLING_422 && subsampling != CK_SUBSAMPLING_420))
     {
         flags.PrintHelp(argv[0]);
         return 1;
     }
 
+    ckp.chroma_subsampling = (ChromaKeyerSubsampling)subsampling;
     ck.setParams(ckp);
 
     // Input file
@@ -88,7 +166,19 @@ int main(int argc, char** argv)
         return 2;
     }
 
-    if(f_automagic)
+    // Background plate
+    if(filebg != std::string())
+    {
+        matbg = imread(filebg);
+        if(matbg.empty() || !ck.setBackground(matbg))
+        {
+            std::cerr << "Could not open the file \"" << filebg << "\"" << std::endl;
+            return 2;
+        }
+
+        matout = ck.composite(f_automagic ? CK_METHOD_AUTOMAGIC : CK_METHOD_CLASSIC);
+    }
+    else if(f_automagic)
         matout = ck.applyChromaKey(CK_METHOD_AUTOMAGIC);
     else
         matout = ck.applyChromaKey(CK_METHOD_CLASSIC);
@@ -97,5 +187,12 @@ int main(int argc, char** argv)
 
     std::cerr << "File \"" << fileout << "\" saved successfully!" << std::endl;
 
+    if(ckp.auto_tolerance && !f_automagic)
+        std::cerr << "Thresholds picked: " << ck.getParams().tolerance_lo << " low, "
+                  << ck.getParams().tolerance_hi << " high" << std::endl;
+
+    if(f_benchmark)
+        benchmarkSubsampling(filein, ckp, f_automagic ? CK_METHOD_AUTOMAGIC : CK_METHOD_CLASSIC);
+
     return 0;
 }